@@ -0,0 +1,40 @@
+#include <Compare.hpp>
+#include <iostream>
+#include <string>
+
+
+int wmain(int argc, wchar_t *argv[]) {
+    if (argc < 3) {
+        std::wcout << "usage: " << argv[0] << " <left disk or image> <right disk or image>" << std::endl;
+        return 2;
+    }
+    std::wcout << "Comparing " << argv[1] << " with " << argv[2] << "..." << std::endl;
+    try {
+        auto report = DiskTools::Compare::CompareSources(argv[1], argv[2]);
+        std::wcout << "sector size: " << report.sectorSize
+                   << ", compared: " << report.comparedBytes
+                   << ", skipped (sparse): " << report.skippedBytes
+                   << ", differing: " << report.differingBytes << std::endl;
+        std::wcout << "differing LBAs: " << DiskTools::Compare::LbaRangesToString(report.ranges) << std::endl;
+        if (report.partitionLayoutsDiffer) {
+            std::wcout << "partition layouts differ" << std::endl;
+        }
+        for (auto &partition: report.leftPartitions) {
+            std::wcout << "left partition " << partition.partition.partitionNumber
+                       << ": " << partition.differingBytes << " bytes differ ("
+                       << DiskTools::Compare::LbaRangesToString(partition.ranges) << ")" << std::endl;
+        }
+        for (auto &partition: report.rightPartitions) {
+            std::wcout << "right partition " << partition.partition.partitionNumber
+                       << ": " << partition.differingBytes << " bytes differ ("
+                       << DiskTools::Compare::LbaRangesToString(partition.ranges) << ")" << std::endl;
+        }
+        return report.ranges.empty() ? 0 : 1;
+    } catch (DiskTools::Types::DiskToolsException &e) {
+        std::wcout << std::endl << "Error: " << e.whatW() << std::endl;
+        if (e.HasFurtherInfo()) {
+            std::wcout << e.GetFurtherInfoW() << std::endl;
+        }
+        return 2;
+    }
+}
@@ -0,0 +1,66 @@
+#include <Usage.hpp>
+#include <iostream>
+#include <string>
+
+
+int wmain(int argc, wchar_t *argv[]) {
+    if (argc < 2) {
+        std::wcout << "usage: " << argv[0] << " <volume root> [tree file]" << std::endl;
+        return 2;
+    }
+    // Resolve the root the same way UsageTree stores it, so relative roots compare correctly
+    auto rootPath = std::wstring(MAX_PATH, L'\0');
+    auto rootLength = GetFullPathNameW(argv[1], (DWORD) rootPath.size(), rootPath.data(), nullptr);
+    if (rootLength > rootPath.size()) {
+        rootPath.resize(rootLength);
+        rootLength = GetFullPathNameW(argv[1], (DWORD) rootPath.size(), rootPath.data(), nullptr);
+    }
+    if (rootLength == 0) {
+        std::wcout << "Error: can not resolve " << argv[1] << std::endl;
+        return 1;
+    }
+    rootPath.resize(rootLength);
+    auto treePath = argc > 2 ? std::wstring(argv[2]) : std::wstring();
+    try {
+        auto tree = DiskTools::Usage::UsageTree();
+        if (!treePath.empty() && GetFileAttributesW(treePath.c_str()) != INVALID_FILE_ATTRIBUTES) {
+            tree = DiskTools::Usage::UsageTree::Load(treePath);
+        }
+        // Only refresh a saved tree that was built for the root we were asked about
+        auto &savedRoot = tree.GetRootPath();
+        if (!tree.IsEmpty() &&
+            CompareStringOrdinal(savedRoot.c_str(), (int) savedRoot.size(), rootPath.c_str(), (int) rootPath.size(),
+                                 TRUE) == CSTR_EQUAL) {
+            std::wcout << "Refreshing " << rootPath << " from " << treePath << "..." << std::endl;
+            tree = tree.Refresh();
+        } else {
+            std::wcout << "Walking " << rootPath << "..." << std::endl;
+            tree = DiskTools::Usage::UsageTree::Build(rootPath);
+        }
+        if (!treePath.empty()) {
+            tree.Save(treePath);
+        }
+
+        auto &stats = tree.GetStats();
+        std::wcout << "listed: " << stats.walkedDirectories << ", reused: " << stats.reusedDirectories
+                   << ", failed: " << stats.failedDirectories << " directories" << std::endl;
+        auto &root = tree.GetRoot();
+        std::wcout << tree.GetRootPath() << ": " << root.allocatedSize << " bytes in " << root.fileCount
+                   << " files" << std::endl;
+        auto shown = 0;
+        for (auto &child: tree.GetChildren(root)) {
+            if (shown++ == 10) {
+                break;
+            }
+            std::wcout << "  " << child.allocatedSize << "\t" << tree.GetName(child) << std::endl;
+        }
+    } catch (DiskTools::Types::DiskToolsException &e) {
+        std::wcout << std::endl << "Error: " << e.whatW() << std::endl;
+        if (e.HasFurtherInfo()) {
+            std::wcout << e.GetFurtherInfoW() << std::endl;
+        }
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#if !defined(DISKCOMPARE_H_)
+#define DISKCOMPARE_H_
+#define DLLExport __declspec(dllexport)
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <gsl/gsl>
+#include <Windows.h>
+#include <Types.hpp>
+
+namespace DiskTools::Compare {
+
+    /**
+     * @brief A run of consecutive logical blocks that differ between the two sources.
+     */
+    struct DLLExport LbaRange {
+        uint64_t firstLba;
+        uint64_t lbaCount;
+    };
+
+    /**
+     * @brief The differing ranges that fall inside a single partition, LBAs are relative to the start of the disk.
+     */
+    struct DLLExport PartitionDiff {
+        Types::PartitionInfo partition;
+        uint64_t differingBytes{};
+        std::vector<LbaRange> ranges;
+    };
+
+    struct DLLExport CompareOptions {
+        /// Number of worker threads, each holding 4 buffers and its own pair of handles.
+        /// 0 picks a small default (at most 4), more only helps sources that serve many parallel streams (NVMe)
+        uint32_t threadCount = 0;
+        /// Size of each read, rounded up to a multiple of the sector size
+        uint32_t bufferSize = 4 * 1024 * 1024;
+        /// Block size used for the report, 0 uses the larger sector size of the two sources
+        uint32_t sectorSize = 0;
+        /// Skip regions that are unallocated in both sources (sparse image files only)
+        bool skipSparse = true;
+    };
+
+    struct DLLExport CompareReport {
+        uint32_t sectorSize{};
+        uint64_t leftSize{};
+        uint64_t rightSize{};
+        uint64_t comparedBytes{};
+        uint64_t skippedBytes{};
+        uint64_t differingBytes{};
+        /// Coalesced list of differing ranges over the whole source, sorted by LBA
+        std::vector<LbaRange> ranges;
+        /// Per partition breakdown against each source's own layout, only filled in when both sources have a
+        /// partition table (the drive layout of a disk, or the MBR/GPT stored at the start of an image file)
+        std::vector<PartitionDiff> leftPartitions;
+        std::vector<PartitionDiff> rightPartitions;
+        /// True when both sources have a partition table and the partition offsets or lengths do not match,
+        /// e.g. a clone with resized partitions
+        bool partitionLayoutsDiffer{};
+    };
+
+    /**
+     * @brief Compare two disks, volumes or image files block by block.
+     * Both sources are read in lockstep with unbuffered, sector aligned reads, the work is split
+     * into one contiguous region per thread. When the sources differ in size the tail of the larger one
+     * is reported as differing.
+     * @param leftPath A device path (e.g. \\\\.\\PhysicalDrive0) or an image file
+     * @param rightPath A device path (e.g. \\\\.\\PhysicalDrive1) or an image file
+     * @param options Tuning options, see CompareOptions
+     * @throws Types::DiskToolsException if a source can not be opened, sized or read
+     * @return A CompareReport with the coalesced differing LBA ranges
+     */
+    DLLExport CompareReport CompareSources(const std::wstring &leftPath, const std::wstring &rightPath,
+                                           const CompareOptions &options = {});
+
+    /**
+     * @brief Get a printable representation of a list of LBA ranges
+     * @param ranges The ranges to format
+     * @return A wstring in the form "first-last, first-last"
+     */
+    DLLExport std::wstring LbaRangesToString(const std::vector<LbaRange> &ranges);
+}
+
+#endif // DISKCOMPARE_H_
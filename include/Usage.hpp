@@ -0,0 +1,136 @@
+#pragma once
+#if !defined(DISKUSAGE_H_)
+#define DISKUSAGE_H_
+#define DLLExport __declspec(dllexport)
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <gsl/gsl>
+#include <Windows.h>
+#include <Types.hpp>
+
+namespace DiskTools::Usage {
+
+    /// Index value used for "no node", e.g. the parent of the root
+    constexpr uint32_t NoNode = 0xFFFFFFFF;
+
+    enum UsageNodeFlags : uint32_t {
+        Directory = 1 << 0,
+        ReparsePoint = 1 << 1,
+        /// The directory could not be opened or listed, its size only covers what was seen
+        Incomplete = 1 << 2,
+    };
+
+    /**
+     * @brief A file or directory in a UsageTree. Directories hold the aggregated size of everything below them.
+     * Children of a node are stored contiguously, sorted by allocated size (largest first).
+     */
+    struct DLLExport UsageNode {
+        uint64_t size;
+        uint64_t allocatedSize;
+        uint64_t fileCount;
+        /// Last write time as a FILETIME
+        uint64_t lastWriteTime;
+        uint32_t parent;
+        uint32_t firstChild;
+        uint32_t childCount;
+        uint32_t nameOffset;
+        uint32_t nameLength;
+        uint32_t flags;
+    };
+
+    struct DLLExport UsageOptions {
+        /// Number of worker threads, 0 picks one per logical processor
+        uint32_t threadCount = 0;
+    };
+
+    struct DLLExport UsageStats {
+        /// Directories that were listed
+        uint64_t walkedDirectories{};
+        /// Directories whose entries were taken from the previous tree because their mtime did not change
+        uint64_t reusedDirectories{};
+        /// Directories that could not be opened or listed
+        uint64_t failedDirectories{};
+    };
+
+    class UsageWalker;
+
+    /**
+     * @brief Space usage of a mounted volume (or any directory), du style.
+     * Nodes and names live in two flat arrays and reference each other by index,
+     * which keeps the tree compact and lets Save/Load write it out as is.
+     * @warning Hard linked files are counted once per link.
+     */
+    class DLLExport UsageTree {
+    public:
+        UsageTree();
+
+        /**
+         * @brief Walk rootPath with a pool of work stealing threads and build the usage tree
+         * @param rootPath A volume root (e.g. C:\\) or any directory, relative paths are stored resolved
+         * @param options Tuning options, see UsageOptions
+         * @throws Types::DiskToolsException if the root can not be opened
+         * @return The aggregated and sorted tree
+         */
+        static UsageTree Build(const std::wstring &rootPath, const UsageOptions &options = {});
+
+        /**
+         * @brief Build a new tree for the same root, only listing the directories whose mtime changed.
+         * Unchanged directories keep their entries from this tree, their subdirectories are still checked.
+         * @note Rewriting a file in place does not touch its directory mtime, such size changes are only
+         * picked up by a full Build.
+         * @throws Types::DiskToolsException if the root can not be opened
+         */
+        [[nodiscard]] UsageTree Refresh(const UsageOptions &options = {}) const;
+
+        /**
+         * @brief Load a tree written by Save
+         * @throws Types::DiskToolsException if the file can not be read or is not a valid usage tree
+         */
+        static UsageTree Load(const std::wstring &path);
+
+        /**
+         * @brief Write the tree to path, the file is replaced atomically
+         * @throws Types::DiskToolsException if the file can not be written
+         */
+        void Save(const std::wstring &path) const;
+
+        [[nodiscard]] bool IsEmpty() const;
+
+        [[nodiscard]] const UsageNode &GetRoot() const;
+
+        [[nodiscard]] const UsageNode &GetNode(uint32_t index) const;
+
+        [[nodiscard]] size_t GetNodeCount() const;
+
+        [[nodiscard]] gsl::span<const UsageNode> GetChildren(const UsageNode &node) const;
+
+        [[nodiscard]] std::wstring_view GetName(const UsageNode &node) const;
+
+        /**
+         * @brief Get the full path of a node, built by walking up to the root
+         */
+        [[nodiscard]] std::wstring GetPath(const UsageNode &node) const;
+
+        /**
+         * @brief Get the root as an absolute path, relative roots given to Build are resolved at build time
+         */
+        [[nodiscard]] const std::wstring &GetRootPath() const;
+
+        [[nodiscard]] const UsageStats &GetStats() const;
+
+    private:
+        std::wstring rootPath;
+        std::vector<UsageNode> nodes;
+        std::vector<wchar_t> names;
+        UsageStats stats{};
+
+        void AggregateAndSort();
+
+        friend class UsageWalker;
+    };
+}
+
+#endif // DISKUSAGE_H_
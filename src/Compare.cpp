@@ -0,0 +1,711 @@
+#include <Compare.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <format>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <winioctl.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define DISKTOOLS_COMPARE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define DISKTOOLS_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define DISKTOOLS_TARGET_AVX2
+#endif
+
+#if !defined(PF_AVX2_INSTRUCTIONS_AVAILABLE)
+#define PF_AVX2_INSTRUCTIONS_AVAILABLE 40
+#endif
+
+namespace DiskTools::Compare {
+    namespace {
+        // Default number of regions read in parallel, enough to keep an SSD queue busy without turning a
+        // spinning disk into a seek storm or committing buffers per logical processor
+        constexpr uint32_t DefaultThreadCount = 4;
+
+        struct ByteRange {
+            uint64_t offset;
+            uint64_t length;
+        };
+
+        struct SourceInfo {
+            uint64_t size{};
+            uint32_t sectorSize{};
+            // Allocated byte ranges, sorted, a non sparse source has a single range covering all of it
+            std::vector<ByteRange> allocated;
+            std::vector<Types::PartitionInfo> partitions;
+        };
+
+        struct RegionResult {
+            std::vector<LbaRange> ranges;
+            uint64_t skippedBytes{};
+            std::exception_ptr error;
+        };
+
+        using BlocksEqualFn = bool (*)(const uint8_t *, const uint8_t *, size_t);
+
+        // The SIMD kernels assume aligned buffers and len a multiple of 128, which holds for any sector size
+#if defined(DISKTOOLS_COMPARE_X86)
+        bool BlocksEqualSse2(const uint8_t *left, const uint8_t *right, size_t len) {
+            auto acc = _mm_setzero_si128();
+            for (size_t i = 0; i < len; i += 64) {
+                auto x0 = _mm_xor_si128(_mm_load_si128((const __m128i *) (left + i)),
+                                        _mm_load_si128((const __m128i *) (right + i)));
+                auto x1 = _mm_xor_si128(_mm_load_si128((const __m128i *) (left + i + 16)),
+                                        _mm_load_si128((const __m128i *) (right + i + 16)));
+                auto x2 = _mm_xor_si128(_mm_load_si128((const __m128i *) (left + i + 32)),
+                                        _mm_load_si128((const __m128i *) (right + i + 32)));
+                auto x3 = _mm_xor_si128(_mm_load_si128((const __m128i *) (left + i + 48)),
+                                        _mm_load_si128((const __m128i *) (right + i + 48)));
+                acc = _mm_or_si128(acc, _mm_or_si128(_mm_or_si128(x0, x1), _mm_or_si128(x2, x3)));
+            }
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+        }
+
+        DISKTOOLS_TARGET_AVX2 bool BlocksEqualAvx2(const uint8_t *left, const uint8_t *right, size_t len) {
+            auto acc = _mm256_setzero_si256();
+            for (size_t i = 0; i < len; i += 128) {
+                auto x0 = _mm256_xor_si256(_mm256_load_si256((const __m256i *) (left + i)),
+                                           _mm256_load_si256((const __m256i *) (right + i)));
+                auto x1 = _mm256_xor_si256(_mm256_load_si256((const __m256i *) (left + i + 32)),
+                                           _mm256_load_si256((const __m256i *) (right + i + 32)));
+                auto x2 = _mm256_xor_si256(_mm256_load_si256((const __m256i *) (left + i + 64)),
+                                           _mm256_load_si256((const __m256i *) (right + i + 64)));
+                auto x3 = _mm256_xor_si256(_mm256_load_si256((const __m256i *) (left + i + 96)),
+                                           _mm256_load_si256((const __m256i *) (right + i + 96)));
+                acc = _mm256_or_si256(acc, _mm256_or_si256(_mm256_or_si256(x0, x1), _mm256_or_si256(x2, x3)));
+            }
+            return _mm256_testz_si256(acc, acc) != 0;
+        }
+#else
+        bool BlocksEqualScalar(const uint8_t *left, const uint8_t *right, size_t len) {
+            return memcmp(left, right, len) == 0;
+        }
+#endif
+
+        BlocksEqualFn SelectKernel() {
+#if defined(DISKTOOLS_COMPARE_X86)
+            if (IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE)) {
+                return BlocksEqualAvx2;
+            }
+            return BlocksEqualSse2;
+#else
+            return BlocksEqualScalar;
+#endif
+        }
+
+        bool IsPowerOfTwo(uint64_t value) {
+            return value != 0 && (value & (value - 1)) == 0;
+        }
+
+        uint64_t RoundUp(uint64_t value, uint64_t multiple) {
+            return (value + multiple - 1) / multiple * multiple;
+        }
+
+        void AppendLba(std::vector<LbaRange> &ranges, uint64_t firstLba, uint64_t lbaCount) {
+            if (!ranges.empty() && ranges.back().firstLba + ranges.back().lbaCount == firstLba) {
+                ranges.back().lbaCount += lbaCount;
+            } else {
+                ranges.push_back(LbaRange{firstLba, lbaCount});
+            }
+        }
+
+        uint64_t RangesToBytes(const std::vector<LbaRange> &ranges, uint32_t sectorSize, uint64_t limit) {
+            uint64_t bytes = 0;
+            for (auto &range: ranges) {
+                auto start = range.firstLba * sectorSize;
+                auto end = std::min((range.firstLba + range.lbaCount) * sectorSize, limit);
+                if (end > start) {
+                    bytes += end - start;
+                }
+            }
+            return bytes;
+        }
+
+        // True if [offset, offset + length) does not touch any allocated range
+        bool IsHole(const std::vector<ByteRange> &allocated, uint64_t offset, uint64_t length) {
+            auto it = std::lower_bound(allocated.begin(), allocated.end(), offset,
+                                       [](const ByteRange &range, uint64_t value) {
+                                           return range.offset + range.length <= value;
+                                       });
+            return it == allocated.end() || it->offset >= offset + length;
+        }
+
+        HANDLE OpenSource(const std::wstring &path, DWORD flags) {
+            auto handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                      OPEN_EXISTING, flags, nullptr);
+            if (handle == INVALID_HANDLE_VALUE) {
+                throw Types::DiskToolsException(std::wstring(L"Failed to open compare source"), GetLastError(), path);
+            }
+            return handle;
+        }
+
+        std::vector<Types::PartitionInfo> QueryPartitions(HANDLE handle) {
+            auto partitions = std::vector<Types::PartitionInfo>();
+            auto bufferSize = sizeof(DRIVE_LAYOUT_INFORMATION_EX) + 16 * sizeof(PARTITION_INFORMATION_EX);
+            auto buffer = std::vector<uint8_t>(bufferSize);
+            auto bytesReturned = DWORD{0};
+            while (!DeviceIoControl(handle, IOCTL_DISK_GET_DRIVE_LAYOUT_EX, nullptr, 0, buffer.data(),
+                                    (DWORD) buffer.size(), &bytesReturned, nullptr)) {
+                if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+                    // Not a partitioned device (volume...), no breakdown for this source
+                    return partitions;
+                }
+                buffer.resize(buffer.size() * 2);
+            }
+            // This cast is safe because the IOCTL filled the buffer with a DRIVE_LAYOUT_INFORMATION_EX
+            auto layout = (DRIVE_LAYOUT_INFORMATION_EX *) buffer.data();
+            if (layout->PartitionStyle == PARTITION_STYLE_RAW) {
+                return partitions;
+            }
+            for (DWORD i = 0; i < layout->PartitionCount; i++) {
+                auto &entry = layout->PartitionEntry[i];
+                if (entry.PartitionLength.QuadPart == 0) {
+                    continue;
+                }
+                if (entry.PartitionStyle == PARTITION_STYLE_MBR && entry.Mbr.PartitionType == PARTITION_ENTRY_UNUSED) {
+                    continue;
+                }
+                auto partition = Types::PartitionInfo();
+                partition.partitionNumber = entry.PartitionNumber;
+                partition.startingOffset = entry.StartingOffset.QuadPart;
+                partition.partitionLength = entry.PartitionLength.QuadPart;
+                partition.partitionType = entry.PartitionStyle == PARTITION_STYLE_MBR ? entry.Mbr.PartitionType : 0;
+                partition.bootIndicator = entry.PartitionStyle == PARTITION_STYLE_MBR && entry.Mbr.BootIndicator;
+                partition.recognizedPartition =
+                        entry.PartitionStyle == PARTITION_STYLE_MBR ? entry.Mbr.RecognizedPartition : true;
+                partition.rewritePartition = entry.RewritePartition;
+                partitions.push_back(partition);
+            }
+            std::sort(partitions.begin(), partitions.end(),
+                      [](const Types::PartitionInfo &a, const Types::PartitionInfo &b) {
+                          return a.startingOffset < b.startingOffset;
+                      });
+            return partitions;
+        }
+
+        template<typename T>
+        T ReadLe(const uint8_t *bytes) {
+            auto value = T{};
+            memcpy(&value, bytes, sizeof(value));
+            return value;
+        }
+
+        bool ReadAt(HANDLE handle, uint64_t offset, uint8_t *buffer, DWORD length) {
+            auto ov = OVERLAPPED{};
+            ov.Offset = (DWORD) (offset & 0xFFFFFFFF);
+            ov.OffsetHigh = (DWORD) (offset >> 32);
+            auto bytesRead = DWORD{0};
+            return ReadFile(handle, buffer, length, &bytesRead, &ov) && bytesRead == length;
+        }
+
+        /**
+         * Read the partition table stored in a disk image, the drive layout IOCTL only works on devices.
+         * GPT images are probed with 512 and 4096 byte sectors, MBR images are assumed to use 512 byte sectors
+         * and only the primary entries are reported (logical partitions inside an extended one are not).
+         */
+        std::vector<Types::PartitionInfo> ReadImagePartitions(HANDLE handle, uint64_t size) {
+            constexpr uint32_t MbrSectorSize = 512;
+            constexpr uint8_t GptProtectiveType = 0xEE;
+            constexpr uint32_t MaxGptEntries = 4096;
+            auto partitions = std::vector<Types::PartitionInfo>();
+            auto mbr = std::array<uint8_t, MbrSectorSize>();
+            if (!ReadAt(handle, 0, mbr.data(), MbrSectorSize) || mbr[510] != 0x55 || mbr[511] != 0xAA) {
+                return partitions;
+            }
+
+            auto isGpt = false;
+            for (auto i = 0; i < 4; i++) {
+                isGpt |= mbr[446 + 16 * i + 4] == GptProtectiveType;
+            }
+            if (!isGpt) {
+                for (auto i = 0; i < 4; i++) {
+                    auto entry = mbr.data() + 446 + 16 * i;
+                    auto startLba = ReadLe<uint32_t>(entry + 8);
+                    auto sectorCount = ReadLe<uint32_t>(entry + 12);
+                    if (entry[4] == PARTITION_ENTRY_UNUSED || sectorCount == 0) {
+                        continue;
+                    }
+                    auto partition = Types::PartitionInfo();
+                    partition.partitionNumber = i + 1;
+                    partition.startingOffset = (uint64_t) startLba * MbrSectorSize;
+                    partition.partitionLength = (uint64_t) sectorCount * MbrSectorSize;
+                    partition.partitionType = entry[4];
+                    partition.bootIndicator = entry[0] == 0x80;
+                    partition.recognizedPartition = true;
+                    partition.rewritePartition = false;
+                    partitions.push_back(partition);
+                }
+                std::sort(partitions.begin(), partitions.end(),
+                          [](const Types::PartitionInfo &a, const Types::PartitionInfo &b) {
+                              return a.startingOffset < b.startingOffset;
+                          });
+                return partitions;
+            }
+
+            for (uint32_t sectorSize: {512U, 4096U}) {
+                auto header = std::vector<uint8_t>(sectorSize);
+                if (!ReadAt(handle, sectorSize, header.data(), sectorSize) ||
+                    memcmp(header.data(), "EFI PART", 8) != 0) {
+                    continue;
+                }
+                auto entriesLba = ReadLe<uint64_t>(header.data() + 72);
+                auto entryCount = ReadLe<uint32_t>(header.data() + 80);
+                auto entrySize = ReadLe<uint32_t>(header.data() + 84);
+                if (entrySize < 128 || entrySize > 4096 || entryCount > MaxGptEntries ||
+                    entriesLba > size / sectorSize ||
+                    entriesLba * sectorSize + (uint64_t) entryCount * entrySize > size) {
+                    return partitions;
+                }
+                auto entries = std::vector<uint8_t>((size_t) entryCount * entrySize);
+                if (!entries.empty() &&
+                    !ReadAt(handle, entriesLba * sectorSize, entries.data(), (DWORD) entries.size())) {
+                    return partitions;
+                }
+                for (uint32_t i = 0; i < entryCount; i++) {
+                    auto entry = entries.data() + (size_t) i * entrySize;
+                    // An all zero partition type GUID marks an unused entry
+                    if (std::all_of(entry, entry + 16, [](uint8_t byte) { return byte == 0; })) {
+                        continue;
+                    }
+                    auto firstLba = ReadLe<uint64_t>(entry + 32);
+                    auto lastLba = ReadLe<uint64_t>(entry + 40);
+                    if (lastLba < firstLba) {
+                        continue;
+                    }
+                    auto partition = Types::PartitionInfo();
+                    partition.partitionNumber = i + 1;
+                    partition.startingOffset = firstLba * sectorSize;
+                    partition.partitionLength = (lastLba - firstLba + 1) * sectorSize;
+                    partition.partitionType = 0;
+                    partition.bootIndicator = false;
+                    partition.recognizedPartition = true;
+                    partition.rewritePartition = false;
+                    partitions.push_back(partition);
+                }
+                std::sort(partitions.begin(), partitions.end(),
+                          [](const Types::PartitionInfo &a, const Types::PartitionInfo &b) {
+                              return a.startingOffset < b.startingOffset;
+                          });
+                return partitions;
+            }
+            return partitions;
+        }
+
+        std::vector<ByteRange> QueryAllocatedRanges(HANDLE handle, const std::wstring &path, uint64_t size) {
+            auto allocated = std::vector<ByteRange>();
+            auto query = FILE_ALLOCATED_RANGE_BUFFER{};
+            query.FileOffset.QuadPart = 0;
+            query.Length.QuadPart = (LONGLONG) size;
+            auto results = std::array<FILE_ALLOCATED_RANGE_BUFFER, 256>();
+            while (query.Length.QuadPart > 0) {
+                auto bytesReturned = DWORD{0};
+                auto ok = DeviceIoControl(handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+                                          results.data(), (DWORD) (results.size() * sizeof(results[0])),
+                                          &bytesReturned, nullptr);
+                if (!ok && GetLastError() != ERROR_MORE_DATA) {
+                    throw Types::DiskToolsException(std::wstring(L"Failed to query allocated ranges"), GetLastError(),
+                                                    path);
+                }
+                auto count = bytesReturned / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+                for (size_t i = 0; i < count; i++) {
+                    allocated.push_back(ByteRange{(uint64_t) results[i].FileOffset.QuadPart,
+                                                  (uint64_t) results[i].Length.QuadPart});
+                }
+                if (ok || count == 0) {
+                    break;
+                }
+                // Continue right after the last range we got back
+                auto end = results[count - 1].FileOffset.QuadPart + results[count - 1].Length.QuadPart;
+                query.Length.QuadPart -= end - query.FileOffset.QuadPart;
+                query.FileOffset.QuadPart = end;
+            }
+            return allocated;
+        }
+
+        SourceInfo QuerySource(const std::wstring &path, bool querySparse) {
+            auto info = SourceInfo();
+            auto handle = OpenSource(path, 0);
+            auto closeHandle = gsl::finally([handle] { CloseHandle(handle); });
+
+            auto lengthInfo = GET_LENGTH_INFORMATION{};
+            auto bytesReturned = DWORD{0};
+            if (DeviceIoControl(handle, IOCTL_DISK_GET_LENGTH_INFO, nullptr, 0, &lengthInfo, sizeof(lengthInfo),
+                                &bytesReturned, nullptr)) {
+                // Disk or volume
+                info.size = lengthInfo.Length.QuadPart;
+                auto geometry = DISK_GEOMETRY_EX{};
+                if (DeviceIoControl(handle, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, nullptr, 0, &geometry,
+                                    sizeof(geometry), &bytesReturned, nullptr)) {
+                    info.sectorSize = geometry.Geometry.BytesPerSector;
+                }
+                info.partitions = QueryPartitions(handle);
+                info.allocated.push_back(ByteRange{0, info.size});
+            } else {
+                // Image file
+                auto fileSize = LARGE_INTEGER{};
+                if (!GetFileSizeEx(handle, &fileSize)) {
+                    throw Types::DiskToolsException(std::wstring(L"Failed to get compare source size"),
+                                                    GetLastError(), path);
+                }
+                info.size = fileSize.QuadPart;
+                info.partitions = ReadImagePartitions(handle, info.size);
+                auto storageInfo = FILE_STORAGE_INFO{};
+                if (GetFileInformationByHandleEx(handle, FileStorageInfo, &storageInfo, sizeof(storageInfo))) {
+                    info.sectorSize = storageInfo.LogicalBytesPerSector;
+                }
+                auto basicInfo = FILE_BASIC_INFO{};
+                if (querySparse &&
+                    GetFileInformationByHandleEx(handle, FileBasicInfo, &basicInfo, sizeof(basicInfo)) &&
+                    (basicInfo.FileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)) {
+                    info.allocated = QueryAllocatedRanges(handle, path, info.size);
+                } else {
+                    info.allocated.push_back(ByteRange{0, info.size});
+                }
+            }
+            if (!IsPowerOfTwo(info.sectorSize)) {
+                info.sectorSize = 512;
+            }
+            return info;
+        }
+
+        /**
+         * A mounted volume only lets reads through up to its file system size, which leaves out the tail
+         * that IOCTL_DISK_GET_LENGTH_INFO still reports (e.g. the NTFS backup boot sector).
+         * This lifts that limit on volume handles, it simply fails on disks and files which have none.
+         */
+        void AllowExtendedDasdIo(HANDLE handle) {
+            // The handle is overlapped, so the FSCTL needs an OVERLAPPED even though it completes right away
+            auto ov = OVERLAPPED{};
+            auto bytesReturned = DWORD{0};
+            if (!DeviceIoControl(handle, FSCTL_ALLOW_EXTENDED_DASD_IO, nullptr, 0, nullptr, 0, nullptr, &ov) &&
+                GetLastError() == ERROR_IO_PENDING) {
+                GetOverlappedResult(handle, &ov, &bytesReturned, TRUE);
+            }
+        }
+
+        /**
+         * Per worker I/O state: one unbuffered overlapped handle per source and two buffer slots per source,
+         * so the next pair of reads is in flight while the current pair is being compared.
+         */
+        class RegionReader {
+        public:
+            RegionReader(const std::wstring &leftPath, const std::wstring &rightPath,
+                         const SourceInfo &left, const SourceInfo &right, size_t chunkSize)
+                    : paths{leftPath, rightPath}, sources{&left, &right}, chunkSize(chunkSize) {
+                try {
+                    for (auto side = 0; side < 2; side++) {
+                        handles[side] = OpenSource(paths[side], FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED |
+                                                                FILE_FLAG_SEQUENTIAL_SCAN);
+                        AllowExtendedDasdIo(handles[side]);
+                        for (auto slot = 0; slot < 2; slot++) {
+                            // VirtualAlloc hands out page aligned memory, which satisfies any sector alignment
+                            buffers[slot][side] = (uint8_t *) VirtualAlloc(nullptr, chunkSize,
+                                                                           MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+                            overlapped[slot][side].hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+                            if (buffers[slot][side] == nullptr || overlapped[slot][side].hEvent == nullptr) {
+                                throw Types::DiskToolsException(std::wstring(L"Failed to allocate compare buffers"),
+                                                                GetLastError(), paths[side]);
+                            }
+                        }
+                    }
+                } catch (...) {
+                    // The destructor does not run for a half built object, free what we got so far
+                    Release();
+                    throw;
+                }
+            }
+
+            RegionReader(const RegionReader &) = delete;
+
+            RegionReader &operator=(const RegionReader &) = delete;
+
+            ~RegionReader() {
+                Release();
+            }
+
+            /**
+             * Start reading both sources into a slot. Each side only reads up to its own end, rounded up to its
+             * own sector size, so an unbuffered read never runs past the end of a device.
+             * @param length Bytes Wait makes valid in the slot, a multiple of the block size and at most chunkSize
+             */
+            void Issue(int slot, uint64_t offset, size_t length) {
+                lengths[slot] = length;
+                for (auto side = 0; side < 2; side++) {
+                    auto &source = *sources[side];
+                    auto available = source.size > offset ? std::min<uint64_t>(length, source.size - offset) : 0;
+                    auto readLength = (DWORD) RoundUp(available, source.sectorSize);
+                    inFlight[slot][side] = false;
+                    if (readLength == 0) {
+                        // Entirely past the end of this source, Wait will zero fill the whole slot
+                        continue;
+                    }
+                    auto &ov = overlapped[slot][side];
+                    ResetEvent(ov.hEvent);
+                    ov.Offset = (DWORD) (offset & 0xFFFFFFFF);
+                    ov.OffsetHigh = (DWORD) (offset >> 32);
+                    if (!ReadFile(handles[side], buffers[slot][side], readLength, nullptr, &ov)) {
+                        auto error = GetLastError();
+                        if (error == ERROR_HANDLE_EOF) {
+                            continue;
+                        } else if (error != ERROR_IO_PENDING) {
+                            throw Types::DiskToolsException(std::wstring(L"Failed to read compare source"), error,
+                                                            paths[side]);
+                        }
+                    }
+                    inFlight[slot][side] = true;
+                }
+            }
+
+            /// Wait for both reads of a slot, anything past the end of a source is zero filled up to the slot length
+            void Wait(int slot) {
+                for (auto side = 0; side < 2; side++) {
+                    auto bytesRead = DWORD{0};
+                    if (inFlight[slot][side]) {
+                        inFlight[slot][side] = false;
+                        if (!GetOverlappedResult(handles[side], &overlapped[slot][side], &bytesRead, TRUE)) {
+                            auto error = GetLastError();
+                            if (error != ERROR_HANDLE_EOF) {
+                                throw Types::DiskToolsException(std::wstring(L"Failed to read compare source"),
+                                                                error, paths[side]);
+                            }
+                            bytesRead = 0;
+                        }
+                    }
+                    if (bytesRead < lengths[slot]) {
+                        memset(buffers[slot][side] + bytesRead, 0, lengths[slot] - bytesRead);
+                    }
+                }
+            }
+
+            [[nodiscard]] const uint8_t *Buffer(int slot, int side) const {
+                return buffers[slot][side];
+            }
+
+        private:
+            std::wstring paths[2];
+            const SourceInfo *sources[2];
+            size_t chunkSize;
+            HANDLE handles[2]{};
+            uint8_t *buffers[2][2]{};
+            OVERLAPPED overlapped[2][2]{};
+            bool inFlight[2][2]{};
+            size_t lengths[2]{};
+
+            /// Cancel outstanding reads and free whatever was acquired, safe on a partially constructed reader
+            void Release() {
+                for (auto side = 0; side < 2; side++) {
+                    if (handles[side] != nullptr && handles[side] != INVALID_HANDLE_VALUE) {
+                        CancelIoEx(handles[side], nullptr);
+                    }
+                }
+                for (auto slot = 0; slot < 2; slot++) {
+                    for (auto side = 0; side < 2; side++) {
+                        if (inFlight[slot][side]) {
+                            auto ignored = DWORD{0};
+                            GetOverlappedResult(handles[side], &overlapped[slot][side], &ignored, TRUE);
+                        }
+                        if (overlapped[slot][side].hEvent != nullptr) {
+                            CloseHandle(overlapped[slot][side].hEvent);
+                        }
+                        if (buffers[slot][side] != nullptr) {
+                            VirtualFree(buffers[slot][side], 0, MEM_RELEASE);
+                        }
+                    }
+                }
+                for (auto side = 0; side < 2; side++) {
+                    if (handles[side] != nullptr && handles[side] != INVALID_HANDLE_VALUE) {
+                        CloseHandle(handles[side]);
+                    }
+                }
+            }
+        };
+
+        void CompareRegion(const std::wstring &leftPath, const std::wstring &rightPath,
+                           const SourceInfo &left, const SourceInfo &right,
+                           uint64_t regionStart, uint64_t regionEnd, size_t chunkSize,
+                           uint32_t blockSize, BlocksEqualFn blocksEqual, std::atomic<bool> &stop,
+                           RegionResult &result) {
+            try {
+                auto reader = RegionReader(leftPath, rightPath, left, right, chunkSize);
+                auto chunkLength = [&](uint64_t offset) {
+                    return (size_t) std::min<uint64_t>(chunkSize, regionEnd - offset);
+                };
+                // Compare whole blocks, the chunk size is already a multiple of the block size
+                auto slotLength = [&](uint64_t offset) {
+                    return (size_t) RoundUp(chunkLength(offset), blockSize);
+                };
+                // Find the next chunk that is not a hole on both sides, counting what we skip
+                auto nextChunk = [&](uint64_t offset) {
+                    while (offset < regionEnd) {
+                        auto length = chunkLength(offset);
+                        if (!IsHole(left.allocated, offset, length) || !IsHole(right.allocated, offset, length)) {
+                            break;
+                        }
+                        result.skippedBytes += length;
+                        offset += length;
+                    }
+                    return offset;
+                };
+
+                auto current = nextChunk(regionStart);
+                auto slot = 0;
+                if (current < regionEnd) {
+                    reader.Issue(slot, current, slotLength(current));
+                }
+                while (current < regionEnd) {
+                    if (stop) {
+                        // Another region failed, the whole compare is going to throw anyway
+                        return;
+                    }
+                    auto length = chunkLength(current);
+                    auto next = nextChunk(current + length);
+                    reader.Wait(slot);
+                    if (next < regionEnd) {
+                        reader.Issue(slot ^ 1, next, slotLength(next));
+                    }
+                    auto leftBuffer = reader.Buffer(slot, 0);
+                    auto rightBuffer = reader.Buffer(slot, 1);
+                    // The last chunk may end inside a block, Wait zero pads it up to the block boundary
+                    for (size_t pos = 0; pos < length; pos += blockSize) {
+                        if (!blocksEqual(leftBuffer + pos, rightBuffer + pos, blockSize)) {
+                            AppendLba(result.ranges, (current + pos) / blockSize, 1);
+                        }
+                    }
+                    current = next;
+                    slot ^= 1;
+                }
+            } catch (...) {
+                result.error = std::current_exception();
+                stop = true;
+            }
+        }
+
+        std::vector<PartitionDiff> BreakdownByPartition(const std::vector<LbaRange> &ranges,
+                                                        const std::vector<Types::PartitionInfo> &partitions,
+                                                        uint32_t blockSize) {
+            auto diffs = std::vector<PartitionDiff>();
+            for (auto &partition: partitions) {
+                auto diff = PartitionDiff();
+                diff.partition = partition;
+                auto startLba = partition.startingOffset / blockSize;
+                auto endLba = RoundUp(partition.startingOffset + partition.partitionLength, blockSize) / blockSize;
+                // Ranges are sorted and disjoint, so start at the first one ending after the partition start
+                auto it = std::lower_bound(ranges.begin(), ranges.end(), startLba,
+                                           [](const LbaRange &range, uint64_t value) {
+                                               return range.firstLba + range.lbaCount <= value;
+                                           });
+                for (; it != ranges.end() && it->firstLba < endLba; ++it) {
+                    auto first = std::max(it->firstLba, startLba);
+                    auto last = std::min(it->firstLba + it->lbaCount, endLba);
+                    diff.ranges.push_back(LbaRange{first, last - first});
+                }
+                diff.differingBytes = RangesToBytes(diff.ranges, blockSize,
+                                                    partition.startingOffset + partition.partitionLength);
+                diffs.push_back(std::move(diff));
+            }
+            return diffs;
+        }
+
+        bool LayoutsDiffer(const std::vector<Types::PartitionInfo> &left,
+                           const std::vector<Types::PartitionInfo> &right) {
+            return !std::equal(left.begin(), left.end(), right.begin(), right.end(),
+                               [](const Types::PartitionInfo &a, const Types::PartitionInfo &b) {
+                                   return a.startingOffset == b.startingOffset &&
+                                          a.partitionLength == b.partitionLength;
+                               });
+        }
+    }
+
+    CompareReport CompareSources(const std::wstring &leftPath, const std::wstring &rightPath,
+                                 const CompareOptions &options) {
+        if (options.sectorSize != 0 && (!IsPowerOfTwo(options.sectorSize) || options.sectorSize < 512)) {
+            throw Types::DiskToolsException(std::wstring(L"Compare sector size must be a power of two >= 512"),
+                                            ERROR_INVALID_PARAMETER, std::to_wstring(options.sectorSize));
+        }
+        auto left = QuerySource(leftPath, options.skipSparse);
+        auto right = QuerySource(rightPath, options.skipSparse);
+
+        auto report = CompareReport();
+        report.leftSize = left.size;
+        report.rightSize = right.size;
+        // Unbuffered reads have to be aligned to the sector size of both sources
+        auto ioAlignment = std::max(left.sectorSize, right.sectorSize);
+        report.sectorSize = options.sectorSize != 0 ? options.sectorSize : ioAlignment;
+        auto readAlignment = std::max(ioAlignment, report.sectorSize);
+        auto chunkSize = (size_t) RoundUp(std::max<uint64_t>(options.bufferSize, readAlignment), readAlignment);
+
+        auto totalSize = std::max(left.size, right.size);
+        auto commonSize = std::min(left.size, right.size);
+        // When the sizes differ, the block holding the end of the shorter source belongs to the differing tail
+        auto compareEnd = left.size == right.size ? commonSize : commonSize / report.sectorSize * report.sectorSize;
+
+        auto chunkCount = (compareEnd + chunkSize - 1) / chunkSize;
+        auto threadCount = options.threadCount != 0
+                           ? options.threadCount
+                           : std::min(std::max(std::thread::hardware_concurrency(), 1U), DefaultThreadCount);
+        threadCount = (uint32_t) std::clamp<uint64_t>(threadCount, 1, std::max<uint64_t>(chunkCount, 1));
+
+        auto blocksEqual = SelectKernel();
+        auto results = std::vector<RegionResult>(threadCount);
+        auto stop = std::atomic<bool>(false);
+        auto workers = std::vector<std::thread>();
+        for (uint32_t i = 0; i < threadCount; i++) {
+            auto regionStart = std::min(chunkCount * i / threadCount * chunkSize, compareEnd);
+            auto regionEnd = std::min(chunkCount * (i + 1) / threadCount * chunkSize, compareEnd);
+            if (regionStart >= regionEnd) {
+                continue;
+            }
+            workers.emplace_back(CompareRegion, std::cref(leftPath), std::cref(rightPath), std::cref(left),
+                                 std::cref(right), regionStart, regionEnd, chunkSize, report.sectorSize,
+                                 blocksEqual, std::ref(stop), std::ref(results[i]));
+        }
+        for (auto &worker: workers) {
+            worker.join();
+        }
+
+        // Regions are contiguous and in order, so concatenating them keeps the list sorted
+        for (auto &result: results) {
+            if (result.error) {
+                std::rethrow_exception(result.error);
+            }
+            for (auto &range: result.ranges) {
+                AppendLba(report.ranges, range.firstLba, range.lbaCount);
+            }
+            report.skippedBytes += result.skippedBytes;
+        }
+        if (totalSize > compareEnd) {
+            auto firstLba = compareEnd / report.sectorSize;
+            auto endLba = RoundUp(totalSize, report.sectorSize) / report.sectorSize;
+            AppendLba(report.ranges, firstLba, endLba - firstLba);
+        }
+        report.comparedBytes = compareEnd - report.skippedBytes;
+        report.differingBytes = RangesToBytes(report.ranges, report.sectorSize, totalSize);
+
+        if (!left.partitions.empty() && !right.partitions.empty()) {
+            report.leftPartitions = BreakdownByPartition(report.ranges, left.partitions, report.sectorSize);
+            report.rightPartitions = BreakdownByPartition(report.ranges, right.partitions, report.sectorSize);
+            report.partitionLayoutsDiffer = LayoutsDiffer(left.partitions, right.partitions);
+        }
+        return report;
+    }
+
+    std::wstring LbaRangesToString(const std::vector<LbaRange> &ranges) {
+        auto formatted = std::wstring();
+        for (auto i = 0; i < ranges.size(); i++) {
+            formatted += std::format(L"{}-{}", ranges[i].firstLba, ranges[i].firstLba + ranges[i].lbaCount - 1);
+            if (i != ranges.size() - 1) {
+                formatted += L", ";
+            }
+        }
+        return formatted;
+    }
+}
@@ -0,0 +1,583 @@
+#include <Usage.hpp>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace DiskTools::Usage {
+    namespace {
+        // Size of the buffer handed to each directory listing call, every call returns a batch of entries
+        constexpr size_t ListingBufferSize = 64 * 1024;
+
+        constexpr char FileMagic[4] = {'D', 'T', 'U', 'T'};
+        constexpr uint32_t FileVersion = 1;
+
+        struct FileHeader {
+            char magic[4];
+            uint32_t version;
+            uint64_t nodeCount;
+            uint64_t nameCount;
+            uint64_t rootPathLength;
+            UsageStats stats;
+        };
+
+        struct WorkItem {
+            uint32_t node;
+            // Matching directory in the previous tree, NoNode if there is none
+            uint32_t previous;
+            std::wstring path;
+        };
+
+        struct WorkQueue {
+            std::mutex lock;
+            std::deque<WorkItem> items;
+        };
+
+        struct PendingChild {
+            UsageNode node;
+            std::wstring name;
+            uint32_t previous;
+        };
+
+        std::wstring JoinPath(const std::wstring &base, std::wstring_view name) {
+            auto path = base;
+            if (!path.ends_with(L"\\")) {
+                path += L"\\";
+            }
+            path += name;
+            return path;
+        }
+
+        bool HasDevicePrefix(const std::wstring &path) {
+            return path.starts_with(L"\\\\?\\") || path.starts_with(L"\\\\.\\");
+        }
+
+        /**
+         * Resolve a root against the current directory, so a saved tree still points at the same place
+         * when it is refreshed from another working directory.
+         */
+        std::wstring ToFullPath(const std::wstring &path) {
+            if (HasDevicePrefix(path)) {
+                return path;
+            }
+            auto size = GetFullPathNameW(path.c_str(), 0, nullptr, nullptr);
+            if (size == 0) {
+                throw Types::DiskToolsException(std::wstring(L"Failed to resolve usage tree root"), GetLastError(),
+                                                path);
+            }
+            auto fullPath = std::wstring(size, L'\0');
+            size = GetFullPathNameW(path.c_str(), size, fullPath.data(), nullptr);
+            fullPath.resize(size);
+            return fullPath;
+        }
+
+        /**
+         * Turn a full path into a \\?\ path, so every path joined below it is not limited to MAX_PATH.
+         * Paths that already use a device or extended prefix are kept as they are.
+         */
+        std::wstring ToExtendedPath(const std::wstring &fullPath) {
+            if (HasDevicePrefix(fullPath)) {
+                return fullPath;
+            }
+            if (fullPath.starts_with(L"\\\\")) {
+                // \\server\share becomes \\?\UNC\server\share
+                return L"\\\\?\\UNC\\" + fullPath.substr(2);
+            }
+            return L"\\\\?\\" + fullPath;
+        }
+
+        bool QueryLastWriteTime(const std::wstring &path, uint64_t &lastWriteTime) {
+            auto handle = CreateFileW(path.c_str(), FILE_READ_ATTRIBUTES,
+                                      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                                      FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+            if (handle == INVALID_HANDLE_VALUE) {
+                return false;
+            }
+            auto basicInfo = FILE_BASIC_INFO{};
+            auto ok = GetFileInformationByHandleEx(handle, FileBasicInfo, &basicInfo, sizeof(basicInfo));
+            CloseHandle(handle);
+            if (ok) {
+                lastWriteTime = basicInfo.LastWriteTime.QuadPart;
+            }
+            return ok;
+        }
+
+        void WriteAll(HANDLE handle, const void *data, size_t length, const std::wstring &path) {
+            auto bytes = (const uint8_t *) data;
+            while (length > 0) {
+                auto written = DWORD{0};
+                auto chunk = (DWORD) std::min<size_t>(length, 1 << 30);
+                if (!WriteFile(handle, bytes, chunk, &written, nullptr)) {
+                    throw Types::DiskToolsException(std::wstring(L"Failed to write usage tree"), GetLastError(), path);
+                }
+                bytes += written;
+                length -= written;
+            }
+        }
+
+        void ReadAll(HANDLE handle, void *data, size_t length, const std::wstring &path) {
+            auto bytes = (uint8_t *) data;
+            while (length > 0) {
+                auto read = DWORD{0};
+                auto chunk = (DWORD) std::min<size_t>(length, 1 << 30);
+                if (!ReadFile(handle, bytes, chunk, &read, nullptr)) {
+                    throw Types::DiskToolsException(std::wstring(L"Failed to read usage tree"), GetLastError(), path);
+                }
+                if (read == 0) {
+                    throw Types::DiskToolsException(std::wstring(L"Usage tree file is truncated"), ERROR_HANDLE_EOF,
+                                                    path);
+                }
+                bytes += read;
+                length -= read;
+            }
+        }
+    }
+
+    /**
+     * Parallel directory walker. Every worker owns a deque: it pushes and pops its own work at the back
+     * (depth first, good locality) and steals from the front of the others when it runs dry.
+     * Workers with nothing to steal sleep until new work is pushed or the walk is over.
+     * Each listed directory appends its children to the tree as one contiguous block.
+     */
+    class UsageWalker {
+    public:
+        UsageWalker(const UsageWalker &) = delete;
+
+        UsageWalker &operator=(const UsageWalker &) = delete;
+
+        UsageWalker(UsageTree &tree, const UsageTree *previous, uint32_t threadCount)
+                : tree(tree), previous(previous) {
+            for (uint32_t i = 0; i < threadCount; i++) {
+                queues.push_back(std::make_unique<WorkQueue>());
+            }
+        }
+
+        void Run(WorkItem root) {
+            Push(0, std::move(root));
+            auto workers = std::vector<std::thread>();
+            for (uint32_t i = 0; i < queues.size(); i++) {
+                workers.emplace_back(&UsageWalker::Worker, this, i);
+            }
+            for (auto &worker: workers) {
+                worker.join();
+            }
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            tree.stats.walkedDirectories = walked;
+            tree.stats.reusedDirectories = reused;
+            tree.stats.failedDirectories = failed;
+        }
+
+        static UsageTree Walk(const std::wstring &root, const UsageTree *previous, const UsageOptions &options) {
+            auto tree = UsageTree();
+            auto rootPath = ToFullPath(root);
+            tree.rootPath = rootPath;
+            auto rootNode = UsageNode{};
+            rootNode.parent = NoNode;
+            rootNode.firstChild = NoNode;
+            rootNode.nameLength = (uint32_t) rootPath.size();
+            rootNode.flags = Directory;
+            // Walk with the extended form, the tree keeps the plain full path
+            auto walkRoot = ToExtendedPath(rootPath);
+            if (!QueryLastWriteTime(walkRoot, rootNode.lastWriteTime)) {
+                throw Types::DiskToolsException(std::wstring(L"Failed to open usage tree root"), GetLastError(),
+                                                rootPath);
+            }
+            tree.nodes.push_back(rootNode);
+            tree.names.insert(tree.names.end(), rootPath.begin(), rootPath.end());
+
+            auto threadCount = options.threadCount != 0 ? options.threadCount : std::thread::hardware_concurrency();
+            auto walker = UsageWalker(tree, previous, std::max(threadCount, 1U));
+            walker.Run(WorkItem{0, previous != nullptr ? 0 : NoNode, walkRoot});
+            tree.AggregateAndSort();
+            return tree;
+        }
+
+    private:
+        UsageTree &tree;
+        const UsageTree *previous;
+        std::vector<std::unique_ptr<WorkQueue>> queues;
+        // Work items pushed but not finished yet, the walk is over when this drops to zero
+        std::atomic<uint64_t> pending{0};
+        // Work items sitting in a deque, idle workers wait on idleSignal until this is non zero
+        std::atomic<int64_t> queued{0};
+        std::mutex idleLock;
+        std::condition_variable idleSignal;
+        std::atomic<uint64_t> walked{0};
+        std::atomic<uint64_t> reused{0};
+        std::atomic<uint64_t> failed{0};
+        std::mutex arenaLock;
+        std::mutex errorLock;
+        std::exception_ptr error;
+
+        void Push(uint32_t self, WorkItem item) {
+            pending++;
+            {
+                // Counted under idleLock so a worker checking the wait predicate can not miss it
+                auto lock = std::lock_guard(idleLock);
+                queued++;
+            }
+            {
+                auto lock = std::lock_guard(queues[self]->lock);
+                queues[self]->items.push_back(std::move(item));
+            }
+            idleSignal.notify_one();
+        }
+
+        bool Pop(uint32_t self, WorkItem &item) {
+            {
+                auto lock = std::lock_guard(queues[self]->lock);
+                if (!queues[self]->items.empty()) {
+                    item = std::move(queues[self]->items.back());
+                    queues[self]->items.pop_back();
+                    queued--;
+                    return true;
+                }
+            }
+            for (size_t i = 1; i < queues.size(); i++) {
+                auto &victim = *queues[(self + i) % queues.size()];
+                auto lock = std::lock_guard(victim.lock);
+                if (!victim.items.empty()) {
+                    item = std::move(victim.items.front());
+                    victim.items.pop_front();
+                    queued--;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void Worker(uint32_t self) {
+            auto item = WorkItem();
+            while (true) {
+                if (!Pop(self, item)) {
+                    auto lock = std::unique_lock(idleLock);
+                    idleSignal.wait(lock, [this] { return queued > 0 || pending == 0; });
+                    if (pending == 0) {
+                        return;
+                    }
+                    continue;
+                }
+                try {
+                    Process(self, item);
+                } catch (...) {
+                    auto lock = std::lock_guard(errorLock);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+                if (--pending == 0) {
+                    // Last item done, wake everyone so they can exit
+                    {
+                        auto lock = std::lock_guard(idleLock);
+                    }
+                    idleSignal.notify_all();
+                }
+            }
+        }
+
+        void Process(uint32_t self, const WorkItem &item) {
+            if (previous != nullptr && item.previous != NoNode) {
+                auto lastWriteTime = uint64_t{0};
+                {
+                    auto lock = std::lock_guard(arenaLock);
+                    lastWriteTime = tree.nodes[item.node].lastWriteTime;
+                }
+                auto &previousNode = previous->nodes[item.previous];
+                if (previousNode.lastWriteTime == lastWriteTime && !(previousNode.flags & Incomplete)) {
+                    Reuse(self, item);
+                    return;
+                }
+            }
+            List(self, item);
+        }
+
+        void List(uint32_t self, const WorkItem &item) {
+            auto handle = CreateFileW(item.path.c_str(), FILE_LIST_DIRECTORY,
+                                      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                                      FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+            if (handle == INVALID_HANDLE_VALUE) {
+                MarkIncomplete(item.node);
+                return;
+            }
+            auto closeHandle = gsl::finally([handle] { CloseHandle(handle); });
+
+            // Subdirectories of the previous tree by name, so changed directories can still reuse their children
+            auto previousDirs = std::unordered_map<std::wstring_view, uint32_t>();
+            if (previous != nullptr && item.previous != NoNode) {
+                auto &previousNode = previous->nodes[item.previous];
+                for (auto i = previousNode.firstChild; i < previousNode.firstChild + previousNode.childCount; i++) {
+                    if (previous->nodes[i].flags & Directory) {
+                        previousDirs.emplace(previous->GetName(previous->nodes[i]), i);
+                    }
+                }
+            }
+
+            auto children = std::vector<PendingChild>();
+            // uint64_t storage keeps the buffer aligned for FILE_ID_BOTH_DIR_INFO
+            auto buffer = std::vector<uint64_t>(ListingBufferSize / sizeof(uint64_t));
+            auto infoClass = FileIdBothDirectoryRestartInfo;
+            while (GetFileInformationByHandleEx(handle, infoClass, buffer.data(), ListingBufferSize)) {
+                infoClass = FileIdBothDirectoryInfo;
+                auto entry = (const FILE_ID_BOTH_DIR_INFO *) buffer.data();
+                while (true) {
+                    auto name = std::wstring_view(entry->FileName, entry->FileNameLength / sizeof(wchar_t));
+                    if (name != L"." && name != L"..") {
+                        auto child = PendingChild{UsageNode{}, std::wstring(name), NoNode};
+                        child.node.lastWriteTime = entry->LastWriteTime.QuadPart;
+                        if (entry->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                            child.node.flags |= Directory;
+                            if (auto it = previousDirs.find(name); it != previousDirs.end()) {
+                                child.previous = it->second;
+                            }
+                        } else {
+                            child.node.size = entry->EndOfFile.QuadPart;
+                            child.node.allocatedSize = entry->AllocationSize.QuadPart;
+                            child.node.fileCount = 1;
+                        }
+                        if (entry->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+                            child.node.flags |= ReparsePoint;
+                        }
+                        children.push_back(std::move(child));
+                    }
+                    if (entry->NextEntryOffset == 0) {
+                        break;
+                    }
+                    entry = (const FILE_ID_BOTH_DIR_INFO *) ((const uint8_t *) entry + entry->NextEntryOffset);
+                }
+            }
+            if (GetLastError() != ERROR_NO_MORE_FILES) {
+                MarkIncomplete(item.node);
+            }
+            walked++;
+            AppendChildren(self, item, children);
+        }
+
+        void Reuse(uint32_t self, const WorkItem &item) {
+            auto &previousNode = previous->nodes[item.previous];
+            auto children = std::vector<PendingChild>();
+            children.reserve(previousNode.childCount);
+            for (auto i = previousNode.firstChild; i < previousNode.firstChild + previousNode.childCount; i++) {
+                auto &previousChild = previous->nodes[i];
+                auto child = PendingChild{UsageNode{}, std::wstring(previous->GetName(previousChild)), NoNode};
+                child.node.flags = previousChild.flags & (Directory | ReparsePoint);
+                child.node.lastWriteTime = previousChild.lastWriteTime;
+                if (previousChild.flags & Directory) {
+                    child.previous = i;
+                    // The parent listing is not refreshed, so get the current mtime of the subdirectory directly
+                    if (!(child.node.flags & ReparsePoint) &&
+                        !QueryLastWriteTime(JoinPath(item.path, child.name), child.node.lastWriteTime)) {
+                        child.node.flags |= Incomplete;
+                        child.previous = NoNode;
+                        failed++;
+                    }
+                } else {
+                    child.node.size = previousChild.size;
+                    child.node.allocatedSize = previousChild.allocatedSize;
+                    child.node.fileCount = 1;
+                }
+                children.push_back(std::move(child));
+            }
+            reused++;
+            AppendChildren(self, item, children);
+        }
+
+        void AppendChildren(uint32_t self, const WorkItem &item, std::vector<PendingChild> &children) {
+            auto firstChild = uint32_t{0};
+            {
+                auto lock = std::lock_guard(arenaLock);
+                firstChild = (uint32_t) tree.nodes.size();
+                for (auto &child: children) {
+                    child.node.parent = item.node;
+                    child.node.firstChild = NoNode;
+                    child.node.nameOffset = (uint32_t) tree.names.size();
+                    child.node.nameLength = (uint32_t) child.name.size();
+                    tree.names.insert(tree.names.end(), child.name.begin(), child.name.end());
+                    tree.nodes.push_back(child.node);
+                }
+                tree.nodes[item.node].firstChild = firstChild;
+                tree.nodes[item.node].childCount = (uint32_t) children.size();
+            }
+            for (uint32_t i = 0; i < children.size(); i++) {
+                auto &child = children[i];
+                // Do not follow junctions and symlinks, they can loop or leave the volume
+                if ((child.node.flags & Directory) && !(child.node.flags & (ReparsePoint | Incomplete))) {
+                    Push(self, WorkItem{firstChild + i, child.previous, JoinPath(item.path, child.name)});
+                }
+            }
+        }
+
+        void MarkIncomplete(uint32_t node) {
+            auto lock = std::lock_guard(arenaLock);
+            tree.nodes[node].flags |= Incomplete;
+            failed++;
+        }
+    };
+
+    UsageTree::UsageTree() = default;
+
+    UsageTree UsageTree::Build(const std::wstring &rootPath, const UsageOptions &options) {
+        return UsageWalker::Walk(rootPath, nullptr, options);
+    }
+
+    UsageTree UsageTree::Refresh(const UsageOptions &options) const {
+        return UsageWalker::Walk(this->rootPath, this->IsEmpty() ? nullptr : this, options);
+    }
+
+    void UsageTree::AggregateAndSort() {
+        // Children are always appended after their parent, so a reverse pass sees every subtree complete
+        for (auto i = this->nodes.size() - 1; i > 0; i--) {
+            auto &node = this->nodes[i];
+            auto &parent = this->nodes[node.parent];
+            parent.size += node.size;
+            parent.allocatedSize += node.allocatedSize;
+            parent.fileCount += node.fileCount;
+        }
+        for (auto &node: this->nodes) {
+            if (node.childCount > 1) {
+                auto first = this->nodes.begin() + node.firstChild;
+                std::sort(first, first + node.childCount, [](const UsageNode &a, const UsageNode &b) {
+                    return a.allocatedSize != b.allocatedSize ? a.allocatedSize > b.allocatedSize : a.size > b.size;
+                });
+            }
+        }
+        // Sorting moved nodes inside their sibling block, point the grandchildren back at them
+        for (uint32_t i = 0; i < this->nodes.size(); i++) {
+            auto &node = this->nodes[i];
+            for (auto child = node.firstChild; child != NoNode && child < node.firstChild + node.childCount; child++) {
+                this->nodes[child].parent = i;
+            }
+        }
+    }
+
+    void UsageTree::Save(const std::wstring &path) const {
+        // Write next to the target and swap it in, so a crash never leaves a half written tree behind
+        auto tempPath = path + L".tmp";
+        auto handle = CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                                  FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (handle == INVALID_HANDLE_VALUE) {
+            throw Types::DiskToolsException(std::wstring(L"Failed to create usage tree file"), GetLastError(),
+                                            tempPath);
+        }
+        {
+            auto closeHandle = gsl::finally([handle] { CloseHandle(handle); });
+            auto header = FileHeader{};
+            std::copy(std::begin(FileMagic), std::end(FileMagic), header.magic);
+            header.version = FileVersion;
+            header.nodeCount = this->nodes.size();
+            header.nameCount = this->names.size();
+            header.rootPathLength = this->rootPath.size();
+            header.stats = this->stats;
+            WriteAll(handle, &header, sizeof(header), tempPath);
+            WriteAll(handle, this->rootPath.data(), this->rootPath.size() * sizeof(wchar_t), tempPath);
+            WriteAll(handle, this->nodes.data(), this->nodes.size() * sizeof(UsageNode), tempPath);
+            WriteAll(handle, this->names.data(), this->names.size() * sizeof(wchar_t), tempPath);
+        }
+        if (!MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+            throw Types::DiskToolsException(std::wstring(L"Failed to replace usage tree file"), GetLastError(), path);
+        }
+    }
+
+    UsageTree UsageTree::Load(const std::wstring &path) {
+        auto handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                  FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (handle == INVALID_HANDLE_VALUE) {
+            throw Types::DiskToolsException(std::wstring(L"Failed to open usage tree file"), GetLastError(), path);
+        }
+        auto closeHandle = gsl::finally([handle] { CloseHandle(handle); });
+
+        auto fileSize = LARGE_INTEGER{};
+        auto header = FileHeader{};
+        if (!GetFileSizeEx(handle, &fileSize)) {
+            throw Types::DiskToolsException(std::wstring(L"Failed to get usage tree file size"), GetLastError(), path);
+        }
+        ReadAll(handle, &header, sizeof(header), path);
+        auto expectedSize = sizeof(header) + header.rootPathLength * sizeof(wchar_t) +
+                            header.nodeCount * sizeof(UsageNode) + header.nameCount * sizeof(wchar_t);
+        if (!std::equal(std::begin(FileMagic), std::end(FileMagic), header.magic) ||
+            header.version != FileVersion || header.nodeCount == 0 || header.nodeCount >= NoNode ||
+            header.nameCount > UINT32_MAX ||
+            header.rootPathLength > UNICODE_STRING_MAX_CHARS || expectedSize != (uint64_t) fileSize.QuadPart) {
+            throw Types::DiskToolsException(std::wstring(L"Not a valid usage tree file"), ERROR_INVALID_DATA, path);
+        }
+
+        auto tree = UsageTree();
+        tree.stats = header.stats;
+        tree.rootPath.resize(header.rootPathLength);
+        tree.nodes.resize(header.nodeCount);
+        tree.names.resize(header.nameCount);
+        ReadAll(handle, tree.rootPath.data(), tree.rootPath.size() * sizeof(wchar_t), path);
+        ReadAll(handle, tree.nodes.data(), tree.nodes.size() * sizeof(UsageNode), path);
+        ReadAll(handle, tree.names.data(), tree.names.size() * sizeof(wchar_t), path);
+
+        // Every index is used unchecked later on, so reject anything that points outside the arrays
+        for (uint32_t i = 0; i < tree.nodes.size(); i++) {
+            auto &node = tree.nodes[i];
+            auto validParent = i == 0 ? node.parent == NoNode : node.parent < i;
+            auto validChildren = node.childCount == 0 ||
+                                 (node.firstChild > i && node.firstChild <= tree.nodes.size() &&
+                                  node.childCount <= tree.nodes.size() - node.firstChild);
+            auto validName = (uint64_t) node.nameOffset + node.nameLength <= tree.names.size();
+            if (!validParent || !validChildren || !validName) {
+                throw Types::DiskToolsException(std::wstring(L"Usage tree file is corrupt"), ERROR_INVALID_DATA,
+                                                path);
+            }
+        }
+        return tree;
+    }
+
+    bool UsageTree::IsEmpty() const {
+        return this->nodes.empty();
+    }
+
+    const UsageNode &UsageTree::GetRoot() const {
+        return this->nodes.front();
+    }
+
+    const UsageNode &UsageTree::GetNode(uint32_t index) const {
+        return this->nodes.at(index);
+    }
+
+    size_t UsageTree::GetNodeCount() const {
+        return this->nodes.size();
+    }
+
+    gsl::span<const UsageNode> UsageTree::GetChildren(const UsageNode &node) const {
+        if (node.childCount == 0) {
+            return {};
+        }
+        return gsl::span<const UsageNode>(this->nodes.data() + node.firstChild, node.childCount);
+    }
+
+    std::wstring_view UsageTree::GetName(const UsageNode &node) const {
+        return std::wstring_view(this->names.data() + node.nameOffset, node.nameLength);
+    }
+
+    std::wstring UsageTree::GetPath(const UsageNode &node) const {
+        auto parts = std::vector<std::wstring_view>();
+        for (auto current = &node; current->parent != NoNode; current = &this->nodes[current->parent]) {
+            parts.push_back(this->GetName(*current));
+        }
+        auto path = this->rootPath;
+        for (auto it = parts.rbegin(); it != parts.rend(); ++it) {
+            path = JoinPath(path, *it);
+        }
+        return path;
+    }
+
+    const std::wstring &UsageTree::GetRootPath() const {
+        return this->rootPath;
+    }
+
+    const UsageStats &UsageTree::GetStats() const {
+        return this->stats;
+    }
+}